@@ -6,13 +6,24 @@
 #include <seastar/util/file.hh>
 
 #include "common.hh"
+#include "sort_key.hh"
 
 void app_config::init_flags(seastar::app_template &app) {
     app.add_options()
         // filename arg to read the name of the file that needs to be sorted
-        ("input-filename,f",
-         boost::program_options::value<std::string>()->required(),
+        ("input-filename,f", boost::program_options::value<std::string>(),
          "Path to the file that has the records.")
+        // list of already sorted files that just need to be merged
+        ("sorted-inputs,s",
+         boost::program_options::value<std::vector<std::string>>()
+             ->multitoken(),
+         "Paths to already sorted files that have to be merged into a single "
+         "sorted file. The first pass is skipped entirely in this mode.")
+        // flag to enable/disable checking the sort order of the sorted inputs
+        ("check-sorted-inputs",
+         boost::program_options::value<bool>()->default_value(false),
+         "Verify that the files passed via --sorted-inputs are sorted while "
+         "merging them")
         // temp directory to store the intermediate files
         ("tempdir,t",
          boost::program_options::value<std::filesystem::path>()->default_value(
@@ -27,27 +38,84 @@ void app_config::init_flags(seastar::app_template &app) {
         // flag to enable/disable verifying the results
         ("verify-results,v",
          boost::program_options::value<bool>()->default_value(false),
-         "Verify the external sort result");
+         "Verify the external sort result")
+        // flag to only plan the sort
+        ("dry-run", boost::program_options::value<bool>()->default_value(false),
+         "Log the plan picked for the sort - run size, merge fan-in, read "
+         "buffer size and the in-memory path - and exit without sorting")
+        // order in which the records have to be sorted
+        ("sort-key,k",
+         boost::program_options::value<std::string>()->default_value(""),
+         "Comma separated list of key fields to sort the records by, each of "
+         "the form <type>:<offset>[:<length>][:asc|:desc] where type is one "
+         "of bytes, ci (case-insensitive ASCII), u8, i8, u<N>be, u<N>le, "
+         "i<N>be or i<N>le (N = 16, 32, 64). By default, the whole record is "
+         "sorted in the ascending byte order.")
+        // flags to bound the temp space used by the sort
+        ("reclaim-temp-space",
+         boost::program_options::value<bool>()->default_value(false),
+         "Release the disk space of the intermediate files as they are merged, "
+         "keeping the temp space usage close to the size of the input")
+        ("reclaim-extent-size",
+         boost::program_options::value<uint64_t>()->default_value(1 << 20),
+         "Size, in bytes, of the extents in which the temp space is released "
+         "and allocated when --reclaim-temp-space is enabled. Has to be a "
+         "multiple of the record size.")
+        // shares of the scheduling groups used by the different sort phases
+        ("read-shares",
+         boost::program_options::value<float>()->default_value(200),
+         "CPU and I/O shares for reading the input and intermediate files")
+        ("write-shares",
+         boost::program_options::value<float>()->default_value(100),
+         "CPU and I/O shares for writing the intermediate and result files")
+        ("sort-shares",
+         boost::program_options::value<float>()->default_value(100),
+         "CPU shares for sorting and merging the records")
+        ("verify-shares",
+         boost::program_options::value<float>()->default_value(50),
+         "CPU and I/O shares for verifying the result file. Verification "
+         "runs after the sort completes, so these shares only matter relative "
+         "to other work on the same reactor.");
 }
 
 app_config::app_config(seastar::app_template &app) {
     auto &args = app.configuration();
 
     // extract the arguments, filling with default values wherever necessary
-    input_filename = args["input-filename"].as<std::string>();
+    if (args.count("input-filename")) {
+        input_filename = args["input-filename"].as<std::string>();
+    }
+    if (args.count("sorted-inputs")) {
+        sorted_input_filenames =
+            args["sorted-inputs"].as<std::vector<std::string>>();
+    }
 
     create_temp_working_dir(args["tempdir"].as<std::filesystem::path>());
 
+    // name the output after the input file or, when merging, after the first
+    // sorted input file
+    const std::string &output_basename =
+        merge_only() ? sorted_input_filenames.front() : input_filename;
     auto output_dir = args["output-dir"].as<std::filesystem::path>();
     if (output_dir.empty()) {
-        output_filename = input_filename + ".sorted";
+        output_filename = output_basename + ".sorted";
     } else {
-        output_filename =
-            output_dir /
-            std::filesystem::path{input_filename}.filename().concat(".sorted");
+        output_filename = output_dir / std::filesystem::path{output_basename}
+                                           .filename()
+                                           .concat(".sorted");
     }
 
     verify_results = args["verify-results"].as<bool>();
+    dry_run = args["dry-run"].as<bool>();
+    check_sorted_inputs = args["check-sorted-inputs"].as<bool>();
+    sort_key_spec = args["sort-key"].as<std::string>();
+    reclaim_temp_space = args["reclaim-temp-space"].as<bool>();
+    reclaim_extent_size = args["reclaim-extent-size"].as<uint64_t>();
+
+    read_shares = args["read-shares"].as<float>();
+    write_shares = args["write-shares"].as<float>();
+    sort_shares = args["sort-shares"].as<float>();
+    verify_shares = args["verify-shares"].as<float>();
 }
 
 seastar::future<bool> app_config::is_valid() const {
@@ -55,11 +123,55 @@ seastar::future<bool> app_config::is_valid() const {
         co_return false;
     }
 
-    if (!co_await seastar::file_exists(input_filename)) {
-        logger.error("input file '{}' doesn't exist", input_filename);
+    if (read_shares <= 0 || write_shares <= 0 || sort_shares <= 0 ||
+        verify_shares <= 0) {
+        logger.error("scheduling group shares have to be positive");
+        co_return false;
+    }
+
+    try {
+        sort_key::parse(sort_key_spec);
+    } catch (const std::invalid_argument &e) {
+        logger.error("invalid --sort-key '{}' : {}", sort_key_spec, e.what());
+        co_return false;
+    }
+
+    if (reclaim_temp_space &&
+        (reclaim_extent_size == 0 || reclaim_extent_size % record_size != 0)) {
+        logger.error("--reclaim-extent-size has to be a non zero multiple of "
+                     "the record size {}",
+                     record_size);
         co_return false;
     }
 
+    if (input_filename.empty() == sorted_input_filenames.empty()) {
+        logger.error(
+            "exactly one of --input-filename or --sorted-inputs is required");
+        co_return false;
+    }
+
+    if (!merge_only()) {
+        if (!co_await seastar::file_exists(input_filename)) {
+            logger.error("input file '{}' doesn't exist", input_filename);
+            co_return false;
+        }
+
+        co_return true;
+    }
+
+    for (const auto &filename : sorted_input_filenames) {
+        if (!co_await seastar::file_exists(filename)) {
+            logger.error("sorted input file '{}' doesn't exist", filename);
+            co_return false;
+        }
+
+        if (co_await seastar::file_size(filename) % record_size != 0) {
+            logger.error("sorted input file '{}' has a partial record",
+                         filename);
+            co_return false;
+        }
+    }
+
     co_return true;
 }
 
@@ -10,9 +10,25 @@ class app_template;
 // struct to hold and pass around the app config
 struct app_config {
     std::string input_filename;
+    // already sorted input files that only need to be merged
+    std::vector<std::string> sorted_input_filenames;
     std::string output_filename;
     std::string temp_working_dir;
     bool verify_results;
+    // only plan the sort and log the plan
+    bool dry_run;
+    bool check_sorted_inputs;
+    // order in which the records have to be sorted - see sort_key.hh
+    std::string sort_key_spec;
+    // release the space of the intermediate files while merging them
+    bool reclaim_temp_space;
+    uint64_t reclaim_extent_size;
+
+    // shares of the scheduling groups running the different sort phases
+    float read_shares;
+    float write_shares;
+    float sort_shares;
+    float verify_shares;
 
     // registers the flags to the app template
     static void init_flags(seastar::app_template &app);
@@ -22,6 +38,9 @@ struct app_config {
 
     seastar::future<bool> is_valid() const;
 
+    // returns true if the app only has to merge the pre-sorted input files
+    bool merge_only() const { return !sorted_input_filenames.empty(); }
+
   private:
     // creates a temporary working directory to be used by the sort
     void create_temp_working_dir(std::filesystem::path tempdir);
@@ -15,7 +15,8 @@ class file;
 
 constexpr size_t record_size = 4 * 1024; // 4K bytes
 
-// TODO : check if this affects the performance somehow
+// default number of records buffered per file being read - the sort planner
+// derives the actual size from the disk properties
 constexpr size_t max_buffer_size_for_read = 100;
 
 extern seastar::logger logger;
@@ -41,11 +42,32 @@ record_generator get_record_iterator(
     seastar::coroutine::experimental::buffer_size_t max_buffer_size,
     seastar::file &f, uint64_t start_offset = 0, uint64_t end_offset = 0);
 
+// a record along with its normalized sort key. The keys are memcmp comparable
+// and all the keys of a sort have the same size, so comparing two records is a
+// plain byte compare irrespective of the sort order.
+struct keyed_record {
+    record key;
+    record data;
+};
+
+// compares the normalized keys of the given records
+inline int compare_keys(const keyed_record &a, const keyed_record &b) {
+    return memcmp(a.key.get(), b.key.get(), a.key.size());
+}
+
 // comparator for records
 class record_greater {
   public:
-    bool operator()(record &a, record &b) {
-        return strncmp(a.get(), b.get(), record_size) > 0;
+    bool operator()(const keyed_record &a, const keyed_record &b) const {
+        return compare_keys(a, b) > 0;
+    }
+};
+
+// comparator to sort records in ascending order
+class record_less {
+  public:
+    bool operator()(const keyed_record &a, const keyed_record &b) const {
+        return compare_keys(a, b) < 0;
     }
 };
 
@@ -57,6 +79,15 @@ seastar::sstring inline generate_first_pass_output_file_name(
            std::to_string(file_id);
 }
 
+// returns the name of the intermediate files produced by the merge levels that
+// precede the last merge of a pass
+seastar::sstring inline generate_merge_level_output_file_name(
+    const seastar::sstring &tempdir, const unsigned int level,
+    const unsigned int file_id) {
+    return tempdir + "/merged_" + std::to_string(seastar::this_shard_id()) +
+           "_" + std::to_string(level) + "_" + std::to_string(file_id);
+}
+
 // returns the name of the intermediate files produced by second pass
 seastar::sstring inline generate_second_pass_output_file_name(
     const seastar::sstring &tempdir,
@@ -64,19 +95,16 @@ seastar::sstring inline generate_second_pass_output_file_name(
     return tempdir + "/final_sorted_" + std::to_string(file_id);
 }
 
-using record_priority_queue =
-    std::priority_queue<record, std::vector<record>, record_greater>;
-
-using record_queue_vector = std::vector<seastar::queue<record>>;
+using record_queue_vector = std::vector<seastar::queue<keyed_record>>;
 
 // comparator and priority queue for a pair of record and its generator's index
 // in the record_queue_vector
-using record_and_generator_pair = std::pair<record, unsigned>;
+using record_and_generator_pair = std::pair<keyed_record, unsigned>;
 class record_and_generator_pair_greater {
   public:
-    bool operator()(record_and_generator_pair &a,
-                    record_and_generator_pair &b) {
-        return strncmp(a.first.get(), b.first.get(), record_size) > 0;
+    bool operator()(const record_and_generator_pair &a,
+                    const record_and_generator_pair &b) const {
+        return compare_keys(a.first, b.first) > 0;
     }
 };
 
@@ -1,65 +1,152 @@
 #include "external_sort.hh"
 
+#include <seastar/core/seastar.hh>
 #include <seastar/core/sharded.hh>
+#include <seastar/core/with_scheduling_group.hh>
 
 #include "app_config.hh"
 #include "first_pass_service.hh"
+#include "scheduling_groups.hh"
+#include "sort_key.hh"
+#include "sort_planner.hh"
 #include "second_pass_service.hh"
 #include "verify_service.hh"
 
-seastar::future<> external_sort(const app_config &config) {
-    logger.info("Starting external sort on file : {}", config.input_filename);
+// returns the pre-sorted input files that have to be merged by this shard -
+// the files are distributed across the shards in a round robin fashion
+static std::vector<seastar::sstring>
+get_sorted_inputs_for_this_shard(const app_config &config) {
+    std::vector<seastar::sstring> filenames;
+    for (auto i = seastar::this_shard_id();
+         i < config.sorted_input_filenames.size(); i += seastar::smp::count) {
+        filenames.emplace_back(config.sorted_input_filenames[i]);
+    }
+    return filenames;
+}
 
+seastar::future<> external_sort(const app_config &config) {
     seastar::sharded<first_pass_service> fps;
     seastar::sharded<second_pass_service> sps;
     seastar::sharded<second_pass_service> final_ps;
     seastar::sharded<verify_service> vs;
 
     seastar::file input_file, output_file;
+    std::optional<sort_scheduling_groups> sgs;
 
     try {
+        // the order in which the records have to be sorted
+        const auto key = sort_key::parse(config.sort_key_spec);
+
+        // pick the run size, merge fan-in and buffer sizes for this input
+        const auto plan = co_await make_sort_plan(config, key);
+        plan.log();
+        if (config.dry_run) {
+            logger.info("Dry run - skipping the sort");
+            co_return;
+        }
 
-        input_file = co_await seastar::open_file_dma(config.input_filename,
-                                                     seastar::open_flags::ro);
-
-        // initialize the first pass service across shards
-        co_await fps.start(input_file.dup(), config.temp_working_dir);
-
-        logger.info("Running first pass");
-
-        // run the first pass
-        co_await fps.invoke_on_all([](first_pass_service &local_service) {
-            return local_service.run();
-        });
+        // create the scheduling groups for the different phases
+        sgs = co_await sort_scheduling_groups::create(config);
+
+        // extent size in which the temp space is reclaimed, 0 to disable
+        const uint64_t reclaim_extent_size =
+            config.reclaim_temp_space ? config.reclaim_extent_size : 0;
+
+        // number of shards that produce a per shard merged file
+        unsigned int merged_shards = seastar::smp::count;
+
+        if (!config.merge_only()) {
+            logger.info("Starting external sort on file : {}",
+                        config.input_filename);
+
+            input_file = co_await seastar::open_file_dma(
+                config.input_filename, seastar::open_flags::ro);
+
+            // initialize the first pass service across shards
+            co_await fps.start(input_file.dup(), config.temp_working_dir, key,
+                               *sgs, plan);
+
+            logger.info("Running first pass");
+
+            // run the first pass
+            co_await fps.invoke_on_all(
+                [&sgs](first_pass_service &local_service) {
+                    return seastar::with_scheduling_group(
+                        sgs->sort, [&local_service] {
+                            return local_service.run();
+                        });
+                });
+
+            logger.info("Completed first pass");
+
+            // initialize the second pass service across shards to merge the
+            // batches produced by the first pass
+            auto get_output_filenames = [](const first_pass_service &fps) {
+                return fps.get_output_filenames();
+            };
+            co_await sps.start(
+                config.temp_working_dir,
+                seastar::sharded_parameter(get_output_filenames, std::ref(fps)),
+                true, key, *sgs, plan, reclaim_extent_size);
+        } else {
+            logger.info("Starting merge of {} sorted files",
+                        config.sorted_input_filenames.size());
+
+            // shards without any input files will not produce a merged file
+            merged_shards =
+                std::min<size_t>(config.sorted_input_filenames.size(),
+                                 seastar::smp::count);
+
+            // initialize the second pass service across shards to merge the
+            // given sorted files
+            co_await sps.start(
+                config.temp_working_dir,
+                seastar::sharded_parameter(get_sorted_inputs_for_this_shard,
+                                           std::cref(config)),
+                false, key, *sgs, plan, reclaim_extent_size,
+                config.check_sorted_inputs);
+        }
 
-        logger.info("Completed first pass");
         logger.info("Running second pass");
 
-        // initialize the second pass service across shards
-        auto get_num_of_files = [](const first_pass_service &fps) {
-            return fps.get_total_files();
-        };
-        co_await sps.start(
-            config.temp_working_dir,
-            seastar::sharded_parameter(get_num_of_files, std::ref(fps)));
-
         // run the second pass
-        co_await sps.invoke_on_all([](second_pass_service &local_service) {
-            return local_service.run();
+        co_await sps.invoke_on_all([&sgs](second_pass_service &local_service) {
+            return seastar::with_scheduling_group(
+                sgs->sort, [&local_service] { return local_service.run(); });
         });
 
         logger.info("Completed second pass");
         logger.info("Running a final pass merging all intermediate files into "
                     "a single sorted file");
 
-        // initialize the final pass
-        co_await final_ps.start(config.temp_working_dir, seastar::smp::count,
-                                config.output_filename);
+        // initialize the final pass with the merged files of the shards - a
+        // user provided file passed through by a shard is read but kept
+        auto shard_outputs =
+            co_await sps.map([](const second_pass_service &local_service) {
+                return std::make_pair(local_service.get_output_filename(),
+                                      local_service.output_is_input());
+            });
+        std::vector<seastar::sstring> merged_filenames, kept_filenames;
+        for (unsigned int i = 0; i < merged_shards; i++) {
+            merged_filenames.push_back(shard_outputs[i].first);
+            if (shard_outputs[i].second) {
+                kept_filenames.push_back(shard_outputs[i].first);
+            }
+        }
+        co_await final_ps.start(config.temp_working_dir,
+                                std::move(merged_filenames), true, key,
+                                *sgs, plan, reclaim_extent_size,
+                                config.check_sorted_inputs,
+                                config.output_filename,
+                                std::move(kept_filenames));
         // run it either locally or on another shard if available
-        co_await final_ps.invoke_on((seastar::smp::count > 1 ? 1 : 0),
-                                    [](second_pass_service &local_service) {
-                                        return local_service.run();
-                                    });
+        co_await final_ps.invoke_on(
+            (seastar::smp::count > 1 ? 1 : 0),
+            [&sgs](second_pass_service &local_service) {
+                return seastar::with_scheduling_group(
+                    sgs->sort,
+                    [&local_service] { return local_service.run(); });
+            });
 
         logger.info("Completed sorting the given file");
         logger.info("Sorted file is stored at : {}", config.output_filename);
@@ -69,19 +156,21 @@ seastar::future<> external_sort(const app_config &config) {
                 config.output_filename, seastar::open_flags::ro);
 
             // initialize the verify service across shards
-            co_await vs.start(output_file.dup());
+            co_await vs.start(output_file.dup(), key);
 
             logger.info("Verifying the sorted result file");
 
-            if (co_await input_file.size() != co_await output_file.size()) {
+            if (plan.input_size != co_await output_file.size()) {
                 throw verification_exception(
                     "sorted result file has a different size than the input "
-                    "file");
+                    "file(s)");
             }
 
             // run the verify service
-            co_await vs.invoke_on_all([](verify_service &local_service) {
-                return local_service.run();
+            co_await vs.invoke_on_all([&sgs](verify_service &local_service) {
+                return seastar::with_scheduling_group(
+                    sgs->verify,
+                    [&local_service] { return local_service.run(); });
             });
 
             // none of the shards threw an exception => verification succeeded;
@@ -107,4 +196,7 @@ seastar::future<> external_sort(const app_config &config) {
     co_await sps.stop();
     co_await final_ps.stop();
     co_await vs.stop();
+    if (sgs) {
+        co_await sgs->destroy();
+    }
 }
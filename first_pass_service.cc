@@ -1,6 +1,9 @@
 #include "first_pass_service.hh"
 
+#include <algorithm>
+
 #include <seastar/core/seastar.hh>
+#include <seastar/core/with_scheduling_group.hh>
 
 #include "common.hh"
 
@@ -36,23 +39,105 @@ seastar::future<> first_pass_service::init() {
 }
 
 seastar::future<>
-first_pass_service::write_pq_to_temp_file(record_priority_queue &pq) {
-    // create the temp file and allocate space
-    auto temp_file_name =
-        generate_first_pass_output_file_name(_tempdir, _temp_file_id++);
-    auto f = co_await seastar::open_file_dma(
-        temp_file_name, seastar::open_flags::wo | seastar::open_flags::create);
-    co_await f.allocate(0, pq.size() * record_size);
-
-    // pop the elements and write them into a temp file
-    uint64_t write_offset = 0;
-    while (!pq.empty()) {
-        co_await f.dma_write<char>(write_offset, pq.top().get(), record_size);
-        write_offset += record_size;
-        pq.pop();
+first_pass_service::write_records_to_temp_file(
+    std::vector<keyed_record> &records) {
+    if (records.empty()) {
+        co_return;
+    }
+
+    if (_run_file && record_less()(records.front(), _run_last_record)) {
+        // this batch doesn't continue the current run - finish that file
+        co_await _run_file.close();
+        _run_file = seastar::file();
+    }
+
+    if (!_run_file) {
+        if (_plan.in_memory && _temp_file_id == 1) {
+            // the shard didn't fit in a single run after all - move the first
+            // run out of the way of the per shard merge output
+            co_await seastar::rename_file(
+                generate_second_pass_output_file_name(_tempdir),
+                generate_first_pass_output_file_name(_tempdir, 0));
+        }
+
+        // create a new temp file - when the shard is sorted in memory, its
+        // single run is directly written as the merged file of the shard
+        auto temp_file_name =
+            _plan.in_memory && _temp_file_id == 0
+                ? generate_second_pass_output_file_name(_tempdir)
+                : generate_first_pass_output_file_name(_tempdir, _temp_file_id);
+        _temp_file_id++;
+        _run_file = co_await seastar::open_file_dma(
+            temp_file_name,
+            seastar::open_flags::wo | seastar::open_flags::create);
+        _run_write_offset = 0;
+    } else {
+        logger.trace("extending the current run with {} records",
+                     records.size());
+    }
+
+    // allocate space and write the records into the temp file
+    co_await _run_file.allocate(_run_write_offset,
+                                records.size() * record_size);
+    for (auto &r : records) {
+        co_await _run_file.dma_write<char>(_run_write_offset, r.data.get(),
+                                           record_size);
+        _run_write_offset += record_size;
+    }
+
+    _run_last_record = std::move(records.back());
+    records.clear();
+}
+
+seastar::future<first_pass_service::batch_order>
+first_pass_service::read_batch(std::vector<keyed_record> &records) {
+    // limit the batch to the run size picked by the planner
+    auto end_offset = _end_offset;
+    if (_plan.records_per_run > 0) {
+        end_offset = std::min(end_offset, _start_offset +
+                                              _plan.records_per_run *
+                                                  record_size);
+    }
+
+    // use generator to read the records one by one
+    auto record_iterator = get_record_iterator(
+        seastar::coroutine::experimental::buffer_size_t{
+            max_buffer_size_for_read},
+        _f, _start_offset, end_offset);
+
+    // in parallel, collect them into this batch while detecting if the
+    // batch is already in ascending or descending order
+    bool ascending = true, descending = true;
+    record_less record_less_;
+    while (auto r = co_await record_iterator()) {
+        keyed_record record;
+        try {
+            // compute the sort key once, as the record is read
+            record = _key.make_keyed_record(std::move(*r));
+        } catch (const std::bad_alloc &e) {
+            // no more memory to hold the key - the record will be read again
+            // as part of the next batch
+            break;
+        }
+
+        if (!records.empty()) {
+            if (record_less_(record, records.back())) {
+                ascending = false;
+            } else if (record_less_(records.back(), record)) {
+                descending = false;
+            }
+        }
+        records.push_back(std::move(record));
     }
 
-    co_await f.close();
+    // generator stopped either due to reaching offset
+    // or due to running out of memory in this shard.
+    // update the _start_offset to mark the number of records read.
+    _start_offset += records.size() * record_size;
+
+    co_return ascending    ? batch_order::ascending
+              : descending ? batch_order::descending
+                           : batch_order::unordered;
 }
 
 seastar::future<> first_pass_service::run() {
@@ -61,35 +146,46 @@ seastar::future<> first_pass_service::run() {
 
     logger.debug("starting first pass");
 
-    record_priority_queue pq;
-    unsigned num_of_records = 0;
+    std::vector<keyed_record> records;
+    unsigned num_of_records = 0, num_of_sorted_batches = 0;
     while (_start_offset < _end_offset) {
-        // use generator to read the records one by one
-        auto records = get_record_iterator(
-            seastar::coroutine::experimental::buffer_size_t{
-                max_buffer_size_for_read},
-            _f, _start_offset, _end_offset);
-
-        // in parallel, push it into a priority_queue
-        // and sort it within this batch
-        while (auto record = co_await records()) {
-            pq.push(std::move(*record));
+        auto order = co_await seastar::with_scheduling_group(
+            _sgs.read, [this, &records] { return read_batch(records); });
+        num_of_records += records.size();
+
+        // sort the batch - natural runs need no sorting
+        if (order == batch_order::ascending) {
+            num_of_sorted_batches++;
+        } else if (order == batch_order::descending) {
+            num_of_sorted_batches++;
+            std::reverse(records.begin(), records.end());
+        } else {
+            std::sort(records.begin(), records.end(), record_less());
         }
 
-        // generator stopped either due to reaching offset
-        // or due to running out of memory in this shard.
-        // update the _start_offset to mark the number of records read.
-        _start_offset += (pq.size()) * record_size;
-        num_of_records += pq.size();
-
-        // save the sorted records in the pq in a temp file
+        // save the sorted records in a temp file
         // TODO : check if the reading can be done in parallel once the write
         // starts
-        co_await write_pq_to_temp_file(pq);
+        co_await seastar::with_scheduling_group(_sgs.write, [this, &records] {
+            return write_records_to_temp_file(records);
+        });
+    }
+
+    if (_run_file) {
+        co_await _run_file.close();
+        _run_file = seastar::file();
     }
 
-    logger.debug("first pass completed : sorted {} entries into {} batches",
-                 num_of_records, _temp_file_id);
+    logger.debug("first pass completed : sorted {} entries into {} batches, "
+                 "{} batches were already in order",
+                 num_of_records, _temp_file_id, num_of_sorted_batches);
+    if (wrote_merged_output()) {
+        logger.debug("records of this shard were sorted in memory - merge "
+                     "will be skipped");
+    } else if (_temp_file_id == 1) {
+        logger.debug("records of this shard are in order - merge will be "
+                     "skipped");
+    }
 
     // close the input file
     co_await _f.close();
@@ -97,8 +193,11 @@ seastar::future<> first_pass_service::run() {
 
 seastar::future<> first_pass_service::stop() {
     logger.debug("stopping service");
-    // close the file, if it is still open - might happen on exceptions
+    // close the files, if they are still open - might happen on exceptions
     if (_f) {
         co_await _f.close();
     }
+    if (_run_file) {
+        co_await _run_file.close();
+    }
 }
@@ -4,6 +4,9 @@
 #include <seastar/core/sharded.hh>
 
 #include "common.hh"
+#include "scheduling_groups.hh"
+#include "sort_key.hh"
+#include "sort_planner.hh"
 
 // Service to read a subset of the file, split them into batches and sort them
 // in-memory
@@ -12,23 +15,63 @@ class first_pass_service : public seastar::sharded<first_pass_service> {
     seastar::sstring _tempdir;
     seastar::file _f;
     unsigned _temp_file_id{0};
+    sort_scheduling_groups _sgs;
+    sort_key _key;
+    sort_plan _plan;
+
+    // the temp file that is currently being written and the last record
+    // written into it. Batches that continue the sort order of this file are
+    // appended to it rather than being written into a new file.
+    seastar::file _run_file;
+    uint64_t _run_write_offset{0};
+    keyed_record _run_last_record;
 
     // this batch has to sort strings from _start_offset to _end_offset
     uint64_t _start_offset;
     uint64_t _end_offset;
 
+    // order of the records in a batch, detected while reading it
+    enum class batch_order { ascending, descending, unordered };
+
     // opens the file and initialises the offsets for this shard
     seastar::future<> init();
-    // write the given prority queue into a temp file in disk
-    seastar::future<> write_pq_to_temp_file(record_priority_queue &pq);
+    // read the next batch of records, that fit in a run, from the input file
+    seastar::future<batch_order>
+    read_batch(std::vector<keyed_record> &records);
+    // write the given sorted records into a temp file in disk
+    seastar::future<>
+    write_records_to_temp_file(std::vector<keyed_record> &records);
 
   public:
     first_pass_service(const seastar::file_handle input_file_handle,
-                       const seastar::sstring &tempdir)
-        : _f(input_file_handle.to_file()), _tempdir(tempdir) {}
+                       const seastar::sstring &tempdir, const sort_key &key,
+                       const sort_scheduling_groups &sgs = {},
+                       const sort_plan &plan = {})
+        : _tempdir(tempdir), _f(input_file_handle.to_file()), _sgs(sgs),
+          _key(key), _plan(plan) {}
 
     unsigned int get_total_files() const { return _temp_file_id; }
 
+    // returns true if the single run of this shard was written directly as
+    // the merged file of the shard
+    bool wrote_merged_output() const {
+        return _plan.in_memory && _temp_file_id == 1;
+    }
+
+    // returns the names of all the sorted batch files written by this shard
+    // that still have to be merged
+    std::vector<seastar::sstring> get_output_filenames() const {
+        std::vector<seastar::sstring> filenames;
+        if (wrote_merged_output()) {
+            return filenames;
+        }
+        for (unsigned int file_id = 0; file_id < _temp_file_id; file_id++) {
+            filenames.push_back(
+                generate_first_pass_output_file_name(_tempdir, file_id));
+        }
+        return filenames;
+    }
+
     // first pass splits the given part of the file into batches and then
     // individually sorts them and writes them into disk.
     seastar::future<> run();
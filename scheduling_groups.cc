@@ -0,0 +1,41 @@
+#include "scheduling_groups.hh"
+
+#include <seastar/core/coroutine.hh>
+
+#include "app_config.hh"
+
+seastar::future<sort_scheduling_groups>
+sort_scheduling_groups::create(const app_config &config) {
+    sort_scheduling_groups sgs;
+    std::exception_ptr ex;
+    try {
+        sgs.read = co_await seastar::create_scheduling_group(
+            "sort_read", config.read_shares);
+        sgs.write = co_await seastar::create_scheduling_group(
+            "sort_write", config.write_shares);
+        sgs.sort = co_await seastar::create_scheduling_group(
+            "sort_cpu", config.sort_shares);
+        sgs.verify = co_await seastar::create_scheduling_group(
+            "sort_verify", config.verify_shares);
+    } catch (...) {
+        ex = std::current_exception();
+    }
+
+    if (ex) {
+        // release the groups created before the failure
+        co_await sgs.destroy();
+        std::rethrow_exception(ex);
+    }
+
+    co_return sgs;
+}
+
+seastar::future<> sort_scheduling_groups::destroy() {
+    for (auto *sg : {&read, &write, &sort, &verify}) {
+        // groups that were never created are still the default group
+        if (*sg != seastar::default_scheduling_group()) {
+            co_await seastar::destroy_scheduling_group(*sg);
+            *sg = seastar::default_scheduling_group();
+        }
+    }
+}
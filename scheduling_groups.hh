@@ -0,0 +1,28 @@
+#pragma once
+
+#include <seastar/core/future.hh>
+#include <seastar/core/scheduling.hh>
+
+// forward declaration
+struct app_config;
+
+// Scheduling groups that isolate the phases of the sort from each other. Each
+// group's shares control both its CPU time and its I/O bandwidth. The default
+// constructed groups are all the seastar default group.
+struct sort_scheduling_groups {
+    // reading records from the input and the intermediate files
+    seastar::scheduling_group read;
+    // writing records into the intermediate and the result files
+    seastar::scheduling_group write;
+    // sorting and merging the records in memory
+    seastar::scheduling_group sort;
+    // verifying the result file
+    seastar::scheduling_group verify;
+
+    // creates the scheduling groups with the shares from the given config
+    static seastar::future<sort_scheduling_groups>
+    create(const app_config &config);
+
+    // destroys all the scheduling groups
+    seastar::future<> destroy();
+};
@@ -1,12 +1,18 @@
 #include "second_pass_service.hh"
 
+#include <algorithm>
+
 #include <boost/iterator/counting_iterator.hpp>
 #include <seastar/core/file.hh>
 #include <seastar/core/queue.hh>
 #include <seastar/core/seastar.hh>
+#include <seastar/core/with_scheduling_group.hh>
 
 #include "common.hh"
 
+// number of merged buffers that can be queued for the writer
+constexpr size_t write_behind_buffers = 2;
+
 seastar::future<> second_pass_service::stop() {
     logger.trace("stopping second_pass_service");
     co_return;
@@ -14,108 +20,359 @@ seastar::future<> second_pass_service::stop() {
 
 seastar::future<>
 second_pass_service::setup_read_from_files(unsigned int file_id) {
-    // open the temp batch file with the given id
-    auto temp_file_name = _generate_input_filename(_tempdir, file_id);
-    auto f = co_await seastar::open_file_dma(temp_file_name,
-                                             seastar::open_flags::ro);
-    auto end_offset = co_await f.size();
+    // open the sorted input file with the given id
+    const auto &input_filename = _merge_inputs[file_id];
+    // user provided files are never removed and only their order is checked
+    const bool user_input =
+        !_remove_inputs || std::find(_kept_inputs.begin(), _kept_inputs.end(),
+                                     input_filename) != _kept_inputs.end();
+    const bool reclaim = !user_input && _reclaim_extent_size > 0;
+    const bool check_sorted = _check_inputs_sorted && user_input;
+    // punching holes into the file requires it to be writable
+    auto f = co_await seastar::open_file_dma(
+        input_filename,
+        reclaim ? seastar::open_flags::rw : seastar::open_flags::ro);
 
-    // read the records one by one and push them into the queue
-    record r;
-    uint64_t start_offset = 0;
-    seastar::queue<record> &record_queue = _record_queues[file_id];
-    while (start_offset < end_offset) {
-        auto r = co_await f.dma_read<char>(start_offset, record_size);
-        co_await record_queue.push_eventually(std::move(r));
-        start_offset += record_size;
-    }
+    seastar::queue<keyed_record> &record_queue = _record_queues[file_id];
+    // the records are read in chunks of the planned buffer size, with the next
+    // chunk being read ahead while the current one is pushed into the queue
+    const uint64_t chunk_size = _plan.read_buffer_size * record_size;
+    std::optional<seastar::future<record>> read_ahead;
+    std::exception_ptr ex;
+    try {
+        auto end_offset = co_await f.size();
+        auto read_chunk = [&f, chunk_size, end_offset](uint64_t offset) {
+            return f.dma_read<char>(offset,
+                                    std::min(chunk_size, end_offset - offset));
+        };
+
+        // read the records chunk by chunk and push them into the queue
+        uint64_t start_offset = 0, reclaimed_offset = 0;
+        keyed_record prev_record;
+        record_greater record_greater_;
+        if (start_offset < end_offset) {
+            read_ahead = read_chunk(start_offset);
+        }
+        while (start_offset < end_offset) {
+            // take the read out of read_ahead before waiting on it, so that
+            // the cleanup below only ever waits on a read still in flight
+            auto chunk_future = std::move(*read_ahead);
+            read_ahead.reset();
+            auto chunk = co_await std::move(chunk_future);
+            if (chunk.size() == 0 || chunk.size() % record_size != 0) {
+                throw std::runtime_error(fmt::format(
+                    "short read from '{}' at offset {}", input_filename,
+                    start_offset));
+            }
 
-    // end of file - push an empty record to signal the consumer
-    co_await record_queue.push_eventually(std::move(record()));
+            // start reading the next chunk before consuming this one
+            if (start_offset + chunk.size() < end_offset) {
+                read_ahead = read_chunk(start_offset + chunk.size());
+            }
 
-    // wait until all records are read and written
-    co_await _record_queues_consumed.wait();
+            for (uint64_t pos = 0; pos < chunk.size(); pos += record_size) {
+                // compute the sort key once, as the record is read
+                auto r =
+                    _key.make_keyed_record(chunk.share(pos, record_size));
+                if (check_sorted) {
+                    // inputs are expected to be sorted already - comparing
+                    // with the previous record is enough to catch a bad input
+                    if (prev_record.data.size() > 0 &&
+                        record_greater_(prev_record, r)) {
+                        throw std::runtime_error(fmt::format(
+                            "input file '{}' is not sorted at offset {}",
+                            input_filename, start_offset));
+                    }
+                    prev_record = {r.key.share(), r.data.share()};
+                }
+                co_await record_queue.push_eventually(std::move(r));
+                start_offset += record_size;
+
+                if (reclaim && start_offset - reclaimed_offset >=
+                                   _reclaim_extent_size) {
+                    // the records of this extent are already in memory -
+                    // give the disk space back to the file system
+                    co_await f.discard(reclaimed_offset,
+                                       _reclaim_extent_size);
+                    reclaimed_offset += _reclaim_extent_size;
+                }
+            }
+        }
+
+        // end of file - push an empty record to signal the consumer
+        co_await record_queue.push_eventually(keyed_record());
+
+        // wait until all records are read and written
+        co_await _record_queues_consumed.wait();
+    } catch (...) {
+        ex = std::current_exception();
+        // unblock the consumer, if it is still waiting on this queue
+        record_queue.abort(ex);
+    }
+
+    if (read_ahead) {
+        // wait for the read in flight before closing the file - its result is
+        // not needed anymore as this producer has already failed
+        try {
+            co_await std::move(*read_ahead);
+        } catch (...) {
+        }
+    }
 
     co_await f.close();
-    co_await seastar::remove_file(temp_file_name);
+    if (ex) {
+        std::rethrow_exception(ex);
+    }
+
+    if (!user_input) {
+        co_await seastar::remove_file(input_filename);
+    }
 }
 
-seastar::future<> second_pass_service::run() {
-    logger.debug("starting second pass");
+seastar::future<>
+second_pass_service::write_to_file(seastar::file &f,
+                                   seastar::queue<record> &write_queue) {
+    try {
+        uint64_t write_offset = 0, allocated_offset = 0;
+        while (true) {
+            auto buffer = co_await write_queue.pop_eventually();
+            if (buffer.size() == 0) {
+                // the merge is complete
+                break;
+            }
 
-    if (_number_of_files <= 1) {
-        assert(_number_of_files == 1 && !_final_run);
-        // only one file exist - rename it to the form expected by the final run
-        co_await seastar::rename_file(
-            generate_first_pass_output_file_name(_tempdir, 0),
-            generate_second_pass_output_file_name(_tempdir));
-        co_await seastar::sync_directory(_tempdir);
-        co_return;
+            const uint64_t buffer_end = write_offset + buffer.size();
+            if (_reclaim_extent_size > 0 && buffer_end > allocated_offset) {
+                // grow the output in whole extents, as the space of the
+                // inputs is being reclaimed
+                const uint64_t extents =
+                    (buffer_end - allocated_offset + _reclaim_extent_size - 1) /
+                    _reclaim_extent_size;
+                co_await f.allocate(allocated_offset,
+                                    extents * _reclaim_extent_size);
+                allocated_offset += extents * _reclaim_extent_size;
+            }
+
+            auto written = co_await f.dma_write<char>(
+                write_offset, buffer.get(), buffer.size());
+            if (written != buffer.size()) {
+                throw std::runtime_error(fmt::format(
+                    "short write to the merged file at offset {}",
+                    write_offset));
+            }
+            write_offset = buffer_end;
+        }
+
+        if (allocated_offset > write_offset) {
+            // release the unused part of the last extent
+            co_await f.truncate(write_offset);
+        }
+    } catch (...) {
+        // unblock the merge, if it is waiting for room in the queue
+        write_queue.abort(std::current_exception());
+        throw;
     }
+}
+
+seastar::future<>
+second_pass_service::merge(std::vector<seastar::sstring> input_filenames,
+                           seastar::sstring output_filename) {
+    _merge_inputs = std::move(input_filenames);
+    const unsigned number_of_inputs = _merge_inputs.size();
 
     // use a single queue per batch to read and write
-    for (unsigned i = 0; i < _number_of_files; i++) {
-        _record_queues.emplace_back(max_buffer_size_for_read);
+    for (unsigned i = 0; i < number_of_inputs; i++) {
+        _record_queues.emplace_back(_plan.read_buffer_size);
     }
 
-    // parallely populate the queues by reading from all the batch files
-    auto setup_read_functor =
-        std::bind(&second_pass_service::setup_read_from_files, this,
-                  std::placeholders::_1);
+    // parallely populate the queues by reading from all the batch files. The
+    // producers run in their own scheduling group so that they can stay ahead
+    // of the merge consuming the queues.
+    auto setup_read_functor = [this](unsigned int file_id) {
+        return seastar::with_scheduling_group(
+            _sgs.read, std::bind(&second_pass_service::setup_read_from_files,
+                                 this, file_id));
+    };
     auto producers_future = seastar::parallel_for_each(
         boost::counting_iterator<unsigned>(0),
-        boost::counting_iterator<unsigned>(_number_of_files),
+        boost::counting_iterator<unsigned>(number_of_inputs),
         std::move(setup_read_functor));
 
-    // populate the priority queue with the first entries from all the queues
-    record_generator_priority_queue pq;
-    co_await seastar::parallel_for_each(
-        boost::counting_iterator<unsigned>(0),
-        boost::counting_iterator<unsigned>(_number_of_files),
-        [&pq, this](unsigned batch_file_id) -> seastar::future<> {
-            seastar::queue<record> &record_queue =
-                _record_queues[batch_file_id];
+    seastar::file f;
+    // merged records are copied into buffers that are written by a separate
+    // writer, so that the merge can move ahead while the writes are in flight
+    seastar::queue<record> write_queue(write_behind_buffers);
+    std::optional<seastar::future<>> writer_future;
+    std::exception_ptr ex;
+    try {
+        // populate the priority queue with the first entries from all the
+        // queues
+        record_generator_priority_queue pq;
+        co_await seastar::parallel_for_each(
+            boost::counting_iterator<unsigned>(0),
+            boost::counting_iterator<unsigned>(number_of_inputs),
+            [&pq, this](unsigned batch_file_id) -> seastar::future<> {
+                seastar::queue<keyed_record> &record_queue =
+                    _record_queues[batch_file_id];
+                auto r = co_await record_queue.pop_eventually();
+                // intermediate files have atleast one record but the user
+                // provided ones might be empty
+                if (r.data.size() > 0) {
+                    pq.emplace(std::move(r), batch_file_id);
+                }
+            });
+
+        // create the output file and start writing into it
+        f = co_await seastar::open_file_dma(output_filename,
+                                            seastar::open_flags::wo |
+                                                seastar::open_flags::create);
+        writer_future = seastar::with_scheduling_group(
+            _sgs.write, std::bind(&second_pass_service::write_to_file, this,
+                                  std::ref(f), std::ref(write_queue)));
+
+        // merge from the pq into the write buffers
+        const size_t write_buffer_size = _plan.read_buffer_size * record_size;
+        auto buffer =
+            record::aligned(f.memory_dma_alignment(), write_buffer_size);
+        size_t buffer_offset = 0;
+        while (!pq.empty()) {
+            auto &t = pq.top();
+            // copy the top into the write buffer
+            std::copy_n(t.first.data.get(), record_size,
+                        buffer.get_write() + buffer_offset);
+            buffer_offset += record_size;
+            if (buffer_offset == write_buffer_size) {
+                co_await write_queue.push_eventually(std::move(buffer));
+                buffer = record::aligned(f.memory_dma_alignment(),
+                                         write_buffer_size);
+                buffer_offset = 0;
+            }
+
+            // pop the top and push the next record from the queue
+            auto queue_id = t.second;
+            pq.pop();
+
+            // check if the queue has further entries
+            seastar::queue<keyed_record> &record_queue =
+                _record_queues[queue_id];
             auto r = co_await record_queue.pop_eventually();
-            // note : all files atleast have one file - so no need to check for
-            // entry validity here
-            pq.emplace(std::move(r), batch_file_id);
-        });
-
-    // create the temp file
-    auto f = co_await seastar::open_file_dma(_output_filename,
-                                             seastar::open_flags::wo |
-                                                 seastar::open_flags::create);
-
-    // write from the pq into the single sorted file
-    uint64_t write_offset = 0;
-    while (!pq.empty()) {
-        auto &t = pq.top();
-        // write the top into file
-        co_await f.dma_write<char>(write_offset, t.first.get(), record_size);
-        write_offset += record_size;
-
-        // pop the top and push the next record from the queue
-        auto queue_id = t.second;
-        pq.pop();
-
-        // check if the queue has further entries
-        seastar::queue<record> &record_queue = _record_queues[queue_id];
-        auto r = co_await record_queue.pop_eventually();
-        if (r.size() > 0) {
-            // a record has been read from the queue
-            pq.emplace(std::move(r), queue_id);
+            if (r.data.size() > 0) {
+                // a record has been read from the queue
+                pq.emplace(std::move(r), queue_id);
+            }
         }
+
+        // write the last partial buffer and signal the writer to complete
+        if (buffer_offset > 0) {
+            buffer.trim(buffer_offset);
+            co_await write_queue.push_eventually(std::move(buffer));
+        }
+        co_await write_queue.push_eventually(record());
+    } catch (...) {
+        ex = std::current_exception();
     }
 
-    // signal all the producers to complete
-    _record_queues_consumed.signal(_number_of_files);
-    co_await std::move(producers_future);
+    if (ex) {
+        // unblock the writer and all the producers so that they can bail out
+        write_queue.abort(ex);
+        for (auto &record_queue : _record_queues) {
+            record_queue.abort(ex);
+        }
+        _record_queues_consumed.broken(ex);
+    } else {
+        // signal all the producers to complete
+        _record_queues_consumed.signal(number_of_inputs);
+    }
+
+    if (writer_future) {
+        try {
+            co_await std::move(*writer_future);
+        } catch (...) {
+            if (!ex) {
+                ex = std::current_exception();
+            }
+        }
+    }
+
+    try {
+        co_await std::move(producers_future);
+    } catch (...) {
+        if (!ex) {
+            ex = std::current_exception();
+        }
+    }
 
     // clenaup
     _record_queues.clear();
-    co_await f.close();
-    // sync tempdir to ensure that the pass1 temp file removals are flushed
-    co_await seastar::sync_directory(_tempdir);
+    _merge_inputs.clear();
+    if (f) {
+        co_await f.close();
+    }
+    if (ex) {
+        std::rethrow_exception(ex);
+    }
+
+    if (_remove_inputs) {
+        // sync tempdir to ensure that the consumed file removals are flushed
+        co_await seastar::sync_directory(_tempdir);
+    }
+}
+
+seastar::future<> second_pass_service::run() {
+    logger.debug("starting second pass");
+
+    if (_input_filenames.empty()) {
+        // nothing was assigned to this shard
+        co_return;
+    }
+
+    // merge the files in levels when there are more of them than can be merged
+    // at once - every level merges groups of similar size
+    unsigned level = 0;
+    while (_input_filenames.size() > _plan.merge_fan_in) {
+        const size_t number_of_files = _input_filenames.size();
+        const size_t number_of_groups =
+            (number_of_files + _plan.merge_fan_in - 1) / _plan.merge_fan_in;
+        std::vector<seastar::sstring> merged_filenames;
+        for (size_t group = 0; group < number_of_groups; group++) {
+            auto first = _input_filenames.begin() +
+                         group * number_of_files / number_of_groups;
+            auto last = _input_filenames.begin() +
+                        (group + 1) * number_of_files / number_of_groups;
+            merged_filenames.push_back(
+                generate_merge_level_output_file_name(_tempdir, level, group));
+            co_await merge(std::vector<seastar::sstring>(first, last),
+                           merged_filenames.back());
+        }
+
+        // the merged files are intermediate files owned by the sort
+        _input_filenames = std::move(merged_filenames);
+        _remove_inputs = true;
+        _check_inputs_sorted = false;
+        level++;
+    }
+
+    if (level > 0) {
+        logger.debug("merged the inputs in {} intermediate levels", level);
+    }
+
+    if (_input_filenames.size() == 1 && !_final_run) {
+        if (_remove_inputs) {
+            // only one intermediate file exist - rename it to the form
+            // expected by the final run
+            co_await seastar::rename_file(_input_filenames[0],
+                                          _output_filename);
+            co_await seastar::sync_directory(_tempdir);
+        } else {
+            // a single user provided file is already sorted - the final run
+            // reads it directly rather than a copy of it
+            _output_filename = _input_filenames[0];
+            _output_is_input = true;
+        }
+        co_return;
+    }
+
+    co_await merge(_input_filenames, _output_filename);
 
     logger.debug("completed second pass");
 }
@@ -1,4 +1,3 @@
-
 #pragma once
 
 #include <seastar/core/future.hh>
@@ -6,6 +5,9 @@
 #include <seastar/core/sharded.hh>
 
 #include "common.hh"
+#include "scheduling_groups.hh"
+#include "sort_key.hh"
+#include "sort_planner.hh"
 
 // Service that runs the second pass of the external sort - this run merges the
 // records from given files into a single file
@@ -15,40 +17,82 @@ class second_pass_service : public seastar::sharded<second_pass_service> {
     // final_run is false and then to merge files across shard when final_run is
     // true
     bool _final_run{false};
-    unsigned int _number_of_files;
+
+    // the sorted files that have to be merged by this service
+    std::vector<seastar::sstring> _input_filenames;
+    // the input files are intermediate files owned by the sort and can be
+    // removed once they are merged. User provided files are never removed.
+    bool _remove_inputs;
+    // user provided files among the inputs of the final pass - they are never
+    // removed, even though the other inputs are
+    std::vector<seastar::sstring> _kept_inputs;
+    // verify the sort order of the user provided input files while reading
+    // them
+    bool _check_inputs_sorted;
+    // when non zero, the disk space of the removable input files is released
+    // in extents of this size as soon as they are read and the output file is
+    // allocated in extents of the same size. This keeps the temp space usage
+    // close to the size of the data being merged.
+    uint64_t _reclaim_extent_size;
 
     seastar::sstring _tempdir, _output_filename;
+    // the output is the only, user provided, input file of this shard - it is
+    // passed to the final pass as is, as there is nothing to merge it with
+    bool _output_is_input{false};
+    sort_scheduling_groups _sgs;
+    sort_key _key;
+    sort_plan _plan;
 
+    // the files being merged by the merge in progress
+    std::vector<seastar::sstring> _merge_inputs;
     record_queue_vector _record_queues;
     seastar::semaphore _record_queues_consumed{0};
 
-    // function wrapper for the input name generator
-    std::function<seastar::sstring(const seastar::sstring &,
-                                   const unsigned int)>
-        _generate_input_filename;
-
     // open the batch files and setup read via queues.
     // note - unable to write this as a lambda due to the
     // 'lambda-coroutine-fiasco'.
     seastar::future<> setup_read_from_files(unsigned int file_id);
 
+    // writes the buffers from the queue into the output file until an empty
+    // buffer is popped - runs in the write scheduling group, behind the merge
+    seastar::future<> write_to_file(seastar::file &f,
+                                    seastar::queue<record> &write_queue);
+
+    // merges the given sorted files into the output file
+    seastar::future<> merge(std::vector<seastar::sstring> input_filenames,
+                            seastar::sstring output_filename);
+
   public:
     second_pass_service(
-        const seastar::sstring &tempdir, unsigned int number_of_files,
-        const seastar::sstring &output_filename = default_sstring)
-        : _tempdir(tempdir), _number_of_files(number_of_files),
-          _output_filename(output_filename) {
+        const seastar::sstring &tempdir,
+        std::vector<seastar::sstring> input_filenames, bool remove_inputs,
+        const sort_key &key, const sort_scheduling_groups &sgs,
+        const sort_plan &plan, uint64_t reclaim_extent_size,
+        bool check_inputs_sorted = false,
+        const seastar::sstring &output_filename = default_sstring,
+        std::vector<seastar::sstring> kept_inputs = {})
+        : _input_filenames(std::move(input_filenames)),
+          _remove_inputs(remove_inputs), _kept_inputs(std::move(kept_inputs)),
+          _check_inputs_sorted(check_inputs_sorted),
+          _reclaim_extent_size(reclaim_extent_size), _tempdir(tempdir),
+          _output_filename(output_filename), _sgs(sgs), _key(key),
+          _plan(plan) {
         if (_output_filename.empty()) {
             // second pass
             _output_filename = generate_second_pass_output_file_name(_tempdir);
-            _generate_input_filename = generate_first_pass_output_file_name;
         } else {
             // final pass
             _final_run = true;
-            _generate_input_filename = generate_second_pass_output_file_name;
         }
     }
 
+    // returns the file holding the merged records of this shard
+    const seastar::sstring &get_output_filename() const {
+        return _output_filename;
+    }
+    // returns true if the output is a user provided file that must be kept
+    bool output_is_input() const { return _output_is_input; }
+
     seastar::future<> run();
     seastar::future<> stop();
 };
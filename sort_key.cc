@@ -0,0 +1,177 @@
+#include "sort_key.hh"
+
+#include <algorithm>
+#include <charconv>
+#include <span>
+#include <stdexcept>
+
+#include <fmt/format.h>
+
+// splits the given string at every occurrence of the delimiter
+static std::vector<std::string_view> split(std::string_view str,
+                                           char delimiter) {
+    std::vector<std::string_view> tokens;
+    size_t pos;
+    while ((pos = str.find(delimiter)) != std::string_view::npos) {
+        tokens.push_back(str.substr(0, pos));
+        str.remove_prefix(pos + 1);
+    }
+    tokens.push_back(str);
+    return tokens;
+}
+
+// parses a non negative integer from the given token
+static size_t parse_size(std::string_view token, std::string_view what) {
+    size_t value;
+    auto [ptr, ec] =
+        std::from_chars(token.data(), token.data() + token.size(), value);
+    if (ec != std::errc() || ptr != token.data() + token.size()) {
+        throw std::invalid_argument(
+            fmt::format("invalid {} '{}' in sort key", what, token));
+    }
+    return value;
+}
+
+// parses the type of a field and its length, if the type implies one
+static sort_key::field parse_field_type(std::string_view token) {
+    sort_key::field f{};
+    if (token == "bytes") {
+        f.type = sort_key::field_type::bytes;
+        return f;
+    }
+    if (token == "ci") {
+        f.type = sort_key::field_type::ascii_ci;
+        return f;
+    }
+
+    // integer types - [u|i]<bits>[be|le]
+    if (token.size() < 2 || (token[0] != 'u' && token[0] != 'i')) {
+        throw std::invalid_argument(
+            fmt::format("unknown field type '{}' in sort key", token));
+    }
+    f.is_signed = token[0] == 'i';
+    token.remove_prefix(1);
+
+    f.type = sort_key::field_type::big_endian_int;
+    if (token.ends_with("be")) {
+        token.remove_suffix(2);
+    } else if (token.ends_with("le")) {
+        f.type = sort_key::field_type::little_endian_int;
+        token.remove_suffix(2);
+    }
+
+    auto bits = parse_size(token, "integer width");
+    if (bits != 8 && bits != 16 && bits != 32 && bits != 64) {
+        throw std::invalid_argument(
+            fmt::format("unsupported integer width '{}' in sort key", bits));
+    }
+    f.length = bits / 8;
+    return f;
+}
+
+sort_key sort_key::parse(std::string_view spec) {
+    sort_key key;
+    if (spec.empty()) {
+        // default order
+        return key;
+    }
+
+    key._key_size = 0;
+    for (auto field_spec : split(spec, ',')) {
+        auto tokens = split(field_spec, ':');
+        if (tokens.size() < 2) {
+            throw std::invalid_argument(fmt::format(
+                "sort key field '{}' has no offset", field_spec));
+        }
+
+        auto f = parse_field_type(tokens[0]);
+        f.offset = parse_size(tokens[1], "offset");
+
+        // optional direction at the end
+        auto remaining = std::span(tokens).subspan(2);
+        if (!remaining.empty() &&
+            (remaining.back() == "asc" || remaining.back() == "desc")) {
+            f.descending = remaining.back() == "desc";
+            remaining = remaining.first(remaining.size() - 1);
+        }
+
+        // optional length for the byte fields
+        const bool is_byte_field = f.type == field_type::bytes ||
+                                   f.type == field_type::ascii_ci;
+        if (!remaining.empty()) {
+            if (!is_byte_field || remaining.size() > 1) {
+                throw std::invalid_argument(fmt::format(
+                    "unexpected arguments in sort key field '{}'", field_spec));
+            }
+            f.length = parse_size(remaining[0], "length");
+        } else if (is_byte_field && f.offset < record_size) {
+            f.length = record_size - f.offset;
+        }
+
+        // written so that a huge offset or length cannot overflow the check
+        if (f.offset >= record_size || f.length == 0 ||
+            f.length > record_size - f.offset) {
+            throw std::invalid_argument(fmt::format(
+                "sort key field '{}' is out of the record bounds", field_spec));
+        }
+
+        key._fields.push_back(f);
+        key._key_size += f.length;
+    }
+
+    if (key._fields.size() == 1 && key._fields[0].type == field_type::bytes &&
+        key._fields[0].offset == 0 && key._fields[0].length == record_size &&
+        !key._fields[0].descending) {
+        // same as the default order - use the record itself as the key
+        key._fields.clear();
+    }
+
+    return key;
+}
+
+void sort_key::encode(const char *data, char *key) const {
+    for (const auto &f : _fields) {
+        const char *begin = data + f.offset;
+        const char *end = begin + f.length;
+        switch (f.type) {
+        case field_type::bytes:
+        case field_type::big_endian_int:
+            std::copy(begin, end, key);
+            break;
+        case field_type::ascii_ci:
+            std::transform(begin, end, key, [](char c) -> char {
+                return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+            });
+            break;
+        case field_type::little_endian_int:
+            std::reverse_copy(begin, end, key);
+            break;
+        }
+
+        if (f.is_signed) {
+            // flip the sign bit so that negative values order before the
+            // positive ones
+            key[0] ^= 0x80;
+        }
+
+        if (f.descending) {
+            // the complement of a fixed size field reverses its order
+            std::transform(key, key + f.length, key,
+                           [](char c) -> char { return ~c; });
+        }
+
+        key += f.length;
+    }
+}
+
+keyed_record sort_key::make_keyed_record(record r) const {
+    if (_fields.empty()) {
+        // the record is its own key
+        auto key = r.share();
+        return {std::move(key), std::move(r)};
+    }
+
+    record key(_key_size);
+    encode(r.get(), key.get_write());
+    return {std::move(key), std::move(r)};
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string_view>
+#include <vector>
+
+#include "common.hh"
+
+// Describes the order in which the records have to be sorted. The order is
+// compiled into a normalized key, computed once per record when it is read,
+// which can be compared with a plain memcmp.
+//
+// The order is specified as a comma separated list of key fields, each of the
+// form <type>:<offset>[:<length>][:asc|:desc], where type is one of
+//   bytes        - raw bytes compared lexicographically
+//   ci           - ASCII bytes compared case-insensitively
+//   u8, i8       - unsigned/signed 8 bit integer
+//   u<N>be/le    - unsigned big/little endian integer, N = 16, 32 or 64
+//   i<N>be/le    - signed big/little endian integer, N = 16, 32 or 64
+// The length is only accepted for bytes and ci fields and defaults to the rest
+// of the record. For example, "bytes:0:desc" sorts the whole record in the
+// descending order and "u32le:8,ci:16:32:desc" sorts by a little endian
+// integer at offset 8 and then by a 32 byte case-insensitive string at offset
+// 16 in descending order.
+class sort_key {
+  public:
+    enum class field_type {
+        bytes,
+        ascii_ci,
+        big_endian_int,
+        little_endian_int
+    };
+
+    struct field {
+        field_type type;
+        size_t offset;
+        size_t length;
+        bool is_signed;
+        bool descending;
+    };
+
+  private:
+    // an empty field list is the default byte-lexicographic ascending order
+    // over the whole record - the record itself is the key in that case.
+    std::vector<field> _fields;
+    size_t _key_size{record_size};
+
+    // writes the normalized key of the given record data into key
+    void encode(const char *data, char *key) const;
+
+  public:
+    sort_key() = default;
+
+    // parses the given sort order specification - throws
+    // std::invalid_argument if the specification is invalid.
+    static sort_key parse(std::string_view spec);
+
+    size_t key_size() const { return _key_size; }
+
+    // returns the memory needed to hold the key in addition to the record
+    size_t key_memory_overhead() const {
+        return _fields.empty() ? 0 : _key_size;
+    }
+
+    // computes the normalized key of the given record
+    keyed_record make_keyed_record(record r) const;
+};
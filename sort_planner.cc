@@ -0,0 +1,194 @@
+#include "sort_planner.hh"
+
+#include <algorithm>
+
+#include <boost/iterator/counting_iterator.hpp>
+#include <seastar/core/coroutine.hh>
+#include <seastar/core/file.hh>
+#include <seastar/core/memory.hh>
+#include <seastar/core/seastar.hh>
+
+#include "app_config.hh"
+#include "sort_key.hh"
+
+// fraction of the shard memory that can be used to hold the records, the rest
+// is left for seastar and the per record book keeping
+constexpr double memory_fraction_for_records = 0.6;
+// bounds for the number of records read at once per file being merged
+constexpr size_t min_read_buffer_size = max_buffer_size_for_read;
+constexpr size_t max_read_buffer_size = 1024;
+// chunks held in memory per file being merged - the queued records, the chunk
+// being pushed into the queue and the chunk being read ahead
+constexpr unsigned read_buffers_per_file = 3;
+// merging more files at once makes the reads increasingly random
+constexpr unsigned max_merge_fan_in = 512;
+
+// amount of data read from the input to measure the disk
+constexpr uint64_t probe_size = 8 << 20;
+// size of the reads used to measure the bandwidth
+constexpr uint64_t probe_read_size = 32 * record_size;
+// properties assumed when the input is too small to be probed
+constexpr std::chrono::microseconds default_read_latency{100};
+constexpr uint64_t default_read_bandwidth = 500 << 20;
+
+// measures the latency of record sized reads and the bandwidth of large
+// parallel reads from the given file
+static seastar::future<> probe_disk(seastar::file &f, uint64_t file_size,
+                                    sort_plan &plan) {
+    plan.read_latency = default_read_latency;
+    plan.read_bandwidth = default_read_bandwidth;
+
+    // sequential record sized reads to measure the latency
+    constexpr unsigned latency_probe_reads = 16;
+    const auto latency_reads =
+        std::min<uint64_t>(latency_probe_reads, file_size / record_size);
+    if (latency_reads == 0) {
+        co_return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < latency_reads; i++) {
+        co_await f.dma_read<char>(i * record_size, record_size);
+    }
+    const auto elapsed_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start);
+    plan.read_latency = std::max(std::chrono::microseconds(1),
+                                 elapsed_us / static_cast<int>(latency_reads));
+
+    // parallel large reads to measure the bandwidth
+    const unsigned bandwidth_reads =
+        std::min(probe_size, file_size) / probe_read_size;
+    if (bandwidth_reads == 0) {
+        co_return;
+    }
+    start = std::chrono::steady_clock::now();
+    co_await seastar::parallel_for_each(
+        boost::counting_iterator<unsigned>(0),
+        boost::counting_iterator<unsigned>(bandwidth_reads),
+        [&f](unsigned i) {
+            return f.dma_read<char>(i * probe_read_size, probe_read_size)
+                .discard_result();
+        });
+    const auto elapsed = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start);
+    if (elapsed.count() > 0) {
+        plan.read_bandwidth =
+            bandwidth_reads * probe_read_size / elapsed.count();
+    }
+}
+
+// returns the number of merge levels needed to merge the given number of
+// files, merging at most fan_in files at once
+static unsigned number_of_merge_levels(uint64_t files, unsigned fan_in) {
+    unsigned levels = 0;
+    while (files > 1) {
+        files = (files + fan_in - 1) / fan_in;
+        levels++;
+    }
+    return levels;
+}
+
+seastar::future<sort_plan> make_sort_plan(const app_config &config,
+                                          const sort_key &key) {
+    sort_plan plan;
+
+    // find the input size and probe the disk with the first input file
+    const auto &probe_filename = config.merge_only()
+                                     ? config.sorted_input_filenames.front()
+                                     : config.input_filename;
+    if (config.merge_only()) {
+        for (const auto &filename : config.sorted_input_filenames) {
+            plan.input_size += co_await seastar::file_size(filename);
+        }
+    } else {
+        plan.input_size = co_await seastar::file_size(config.input_filename);
+    }
+
+    auto f = co_await seastar::open_file_dma(probe_filename,
+                                             seastar::open_flags::ro);
+    std::exception_ptr ex;
+    try {
+        co_await probe_disk(f, co_await f.size(), plan);
+    } catch (...) {
+        ex = std::current_exception();
+    }
+    co_await f.close();
+    if (ex) {
+        std::rethrow_exception(ex);
+    }
+
+    // the shards are assumed to have the same amount of memory
+    plan.memory_per_shard = seastar::memory::stats().total_memory();
+    const uint64_t memory_for_records =
+        plan.memory_per_shard * memory_fraction_for_records;
+    const uint64_t bytes_per_record =
+        record_size + key.key_memory_overhead() + sizeof(keyed_record);
+
+    // read enough records at once per file, while the previous chunk is being
+    // consumed, to cover the latency of a read at the measured bandwidth
+    const uint64_t bandwidth_delay_product =
+        plan.read_bandwidth * plan.read_latency.count() / 1000000;
+    plan.read_buffer_size =
+        std::clamp<uint64_t>(bandwidth_delay_product / record_size,
+                             min_read_buffer_size, max_read_buffer_size);
+
+    // merge as many files at once as their read buffers fit in memory
+    plan.merge_fan_in = std::clamp<uint64_t>(
+        memory_for_records / (read_buffers_per_file * plan.read_buffer_size *
+                              bytes_per_record),
+        2, max_merge_fan_in);
+
+    if (config.merge_only()) {
+        // the files are already sorted runs
+        plan.runs_per_shard =
+            (config.sorted_input_filenames.size() + seastar::smp::count - 1) /
+            seastar::smp::count;
+    } else {
+        // fill the memory with a run
+        const uint64_t total_records = plan.input_size / record_size;
+        const uint64_t records_per_shard =
+            (total_records + seastar::smp::count - 1) / seastar::smp::count;
+        plan.records_per_run =
+            std::clamp<uint64_t>(memory_for_records / bytes_per_record, 1,
+                                 std::max<uint64_t>(records_per_shard, 1));
+        plan.runs_per_shard = (records_per_shard + plan.records_per_run - 1) /
+                              plan.records_per_run;
+        plan.in_memory = plan.runs_per_shard <= 1;
+    }
+
+    co_return plan;
+}
+
+void sort_plan::log() const {
+    logger.info("Sort plan :");
+    logger.info("  input size              : {} bytes", input_size);
+    logger.info("  shards                  : {}", seastar::smp::count);
+    logger.info("  memory per shard        : {} bytes", memory_per_shard);
+    logger.info("  measured read latency   : {} us", read_latency.count());
+    logger.info("  measured read bandwidth : {} bytes/s", read_bandwidth);
+    if (records_per_run > 0) {
+        logger.info("  records per run         : {}", records_per_run);
+    }
+    logger.info("  runs per shard          : {}{}", runs_per_shard,
+                in_memory ? " (sorted in memory, per shard merge skipped)"
+                          : "");
+    logger.info("  merge fan-in            : {}", merge_fan_in);
+    logger.info("  read buffer size        : {} records", read_buffer_size);
+
+    // the merge levels follow from the fan-in, the second pass merges in
+    // levels whenever there are more files than the fan-in
+    const unsigned shard_merge_levels =
+        in_memory ? 0 : number_of_merge_levels(runs_per_shard, merge_fan_in);
+    const unsigned final_merge_levels =
+        number_of_merge_levels(seastar::smp::count, merge_fan_in);
+    logger.info("  expected merge levels   : {} per shard, {} final",
+                shard_merge_levels, final_merge_levels);
+
+    // every pass reads and writes all the data once
+    const unsigned passes = (records_per_run > 0 ? 1 : 0) +
+                            shard_merge_levels + final_merge_levels;
+    if (read_bandwidth > 0) {
+        logger.info("  estimated disk time     : {:.1f} s ({} passes)",
+                    2.0 * passes * input_size / read_bandwidth, passes);
+    }
+}
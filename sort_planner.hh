@@ -0,0 +1,49 @@
+#pragma once
+
+#include <chrono>
+#include <limits>
+
+#include <seastar/core/future.hh>
+
+#include "common.hh"
+
+// forward declarations
+struct app_config;
+class sort_key;
+
+// Shape of the sort pipeline - derived from the input size, the memory
+// available per shard and a quick probe of the disk holding the input. The
+// default constructed plan reads as many records as fit in memory into a run
+// and merges all the runs at once.
+struct sort_plan {
+    // measured properties of the disk
+    std::chrono::microseconds read_latency{0};
+    // read bandwidth in bytes per second
+    uint64_t read_bandwidth{0};
+
+    // size of all the input files together
+    uint64_t input_size{0};
+    uint64_t memory_per_shard{0};
+
+    // number of records sorted in memory into a single run by the first pass,
+    // 0 reads records until the shard runs out of memory
+    uint64_t records_per_run{0};
+    // expected number of runs produced per shard
+    uint64_t runs_per_shard{0};
+    // maximum number of files merged at once - more files are merged in levels
+    unsigned merge_fan_in{std::numeric_limits<unsigned>::max()};
+    // number of records read with a single read, and buffered, per file being
+    // merged. The next chunk is read ahead while the current one is consumed.
+    size_t read_buffer_size{max_buffer_size_for_read};
+    // the records of a shard fit in memory - the first pass writes the single
+    // run of each shard directly as the shard's merged file, skipping the per
+    // shard merge
+    bool in_memory{false};
+
+    // logs the plan
+    void log() const;
+};
+
+// probes the disk and plans the sort of the inputs in the given config
+seastar::future<sort_plan> make_sort_plan(const app_config &config,
+                                          const sort_key &key);
@@ -2,29 +2,40 @@
 #include "common.hh"
 
 seastar::future<> verify_service::run() {
-    // open the file and init offsets for the shard
-    co_await init();
-
-    // To ensure that the records handled by this shard are also sorted
-    // lexicographically w.r.to the records handled by other shards, include two
-    // additional records - one before the start_offset and one after the
-    // end_offset when verification is done. When each shard is in order within
-    // itself and w.r.to these two additional records, the whole file will be in
-    // order.
-    if (seastar::this_shard_id() != 0) {
-        // skip decreasing offset in the first shard
-        _start_offset -= record_size;
-    }
+    const auto total_records = co_await _f.size() / record_size;
+    if (total_records <= seastar::smp::count) {
+        // too few records to split them across the shards - the first shard
+        // verifies all of them
+        if (seastar::this_shard_id() != 0 || total_records == 0) {
+            co_return;
+        }
+        _start_offset = 0;
+        _end_offset = total_records * record_size;
+    } else {
+        // open the file and init offsets for the shard
+        co_await init();
 
-    if (seastar::this_shard_id() != seastar::smp::count - 1) {
-        // skip increasing offset in the last shard
-        _end_offset += record_size;
+        // To ensure that the records handled by this shard are also sorted
+        // lexicographically w.r.to the records handled by other shards,
+        // include two additional records - one before the start_offset and
+        // one after the end_offset when verification is done. When each shard
+        // is in order within itself and w.r.to these two additional records,
+        // the whole file will be in order.
+        if (seastar::this_shard_id() != 0) {
+            // skip decreasing offset in the first shard
+            _start_offset -= record_size;
+        }
+
+        if (seastar::this_shard_id() != seastar::smp::count - 1) {
+            // skip increasing offset in the last shard
+            _end_offset += record_size;
+        }
     }
 
     logger.debug("started verifying the result {} {}", _start_offset,
                  _end_offset);
 
-    record prev_record;
+    keyed_record prev_record;
     record_greater record_greater_;
     while (_start_offset < _end_offset) {
         // use generator to read the records one by one
@@ -36,17 +47,19 @@ seastar::future<> verify_service::run() {
 
         int records_read = 0;
 
-        if (prev_record.size() == 0) {
-            prev_record = std::move(*(co_await records()));
+        if (prev_record.data.size() == 0) {
+            prev_record =
+                _key.make_keyed_record(std::move(*(co_await records())));
             records_read++;
         }
 
-        while (auto record = co_await records()) {
-            if (record_greater_(prev_record, *record)) {
+        while (auto r = co_await records()) {
+            auto record = _key.make_keyed_record(std::move(*r));
+            if (record_greater_(prev_record, record)) {
                 // wrong sort order
                 throw verification_exception("file is incorrectly sorted");
             }
-            prev_record = std::move(*record);
+            prev_record = std::move(record);
             records_read++;
         }
 
@@ -9,8 +9,9 @@
 class verify_service : public seastar::sharded<verify_service>,
                        private first_pass_service {
   public:
-    verify_service(const seastar::file_handle output_file_handle)
-        : first_pass_service(output_file_handle, "") {}
+    verify_service(const seastar::file_handle output_file_handle,
+                   const sort_key &key)
+        : first_pass_service(output_file_handle, "", key) {}
 
     seastar::future<> run();
     seastar::future<> stop() { return first_pass_service::stop(); }